@@ -0,0 +1,346 @@
+/*
+ *  benchBMP.c
+ *
+ *  Benchmark of oldmyfunction.c (linked in through benchOld.c) against myfunction.c on synthetic square images
+ *  from 64x64 up to 16384x16384, doubling the side each step.
+ *  Every stage (blur, filtered blur, sharpen, copy, I/O) is run a number of times on a fresh copy of the image,
+ *  and the median/p95 wall time, median user time (all threads), Mpixel/s and the speedup over the baseline are reported.
+ *  I/O (ImageLoad + writeBMP) is shared code, so it has a single row.
+ *  With -g the Gaussian blur is benchmarked instead: doGaussianBlur (three box passes) for sigma 1 to 32 against a direct
+ *  2D Gaussian convolution of radius 3 sigma through doConvolution (only up to maxDirectSigma, its cost goes with
+ *  sigma^2), and how far apart the two results are (max/mean difference over the pixels both of them blur).
+ *
+ *  -D benchmarks on synthetic pages (mostly flat paper, see synthesizeDocument) instead of random images,
+ *  -u turns on skipUniformTiles.
+ *
+ *  usage: benchBMP [-r runs] [-M minSide] [-m maxSide] [-b maxBaselineSide] [-t threads] [-g] [-G maxDirectSigma]
+ *                  [-D] [-u] [-f csv|json] [-o report] [-d tmpdir]
+ *  The report goes to a file (bench.csv / bench.json by default) since the loader prints to stdout.
+ */
+
+#include <stdio.h>      // Header file for standard file i/o.
+#include <stdlib.h>     // Header file for malloc/free.
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "readBMP.h"
+#include "synthBMP.h"
+
+#include "writeBMP.h"
+
+Image *image; // data structure for image
+unsigned long n, m; // width and height
+
+#include "myfunction.c"
+
+// baseline stages, see benchOld.c
+void oldBlurStage(void);
+void oldFilteredBlurStage(void);
+void oldSharpenStage(void);
+void oldCopyStage(void);
+
+typedef void (*stage_function)(void);
+
+static void blurStage(void) {
+	doConvolution(image, KERNEL_SIZE, blurKernel, 9, false);
+}
+
+static void filteredBlurStage(void) {
+	doConvolution(image, KERNEL_SIZE, blurKernel, 7, true);
+}
+
+static void sharpenStage(void) {
+	doConvolution(image, KERNEL_SIZE, sharpKernel, 1, false);
+}
+
+static void copyStage(void) {
+	pixel *pixels = malloc(m*n*sizeof(pixel));
+	charsToPixels(image, pixels);
+	pixelsToChars(pixels, image);
+	free(pixels);
+}
+
+// the synthetic image on disk and where the I/O stage writes it back
+static char benchFile[4096], benchOut[4096];
+
+static void ioStage(void) {
+	Image loaded;
+	if (!ImageLoad(benchFile, &loaded)) {
+		exit(1);
+	}
+	writeBMP(&loaded, benchFile, benchOut);
+	ImageFree(&loaded);
+}
+
+// the Gaussian of gaussianBench: the sigma doGaussianBlur gets and the direct kernel it is compared with
+static double benchSigma;
+static int directSize, directScale;
+static int *directKernel;
+
+static void gaussianBoxesStage(void) {
+	doGaussianBlur(image, benchSigma);
+}
+
+static void gaussianDirectStage(void) {
+	doConvolution(image, directSize, (int (*)[directSize]) directKernel, directScale, false);
+}
+
+typedef struct {
+	const char *name;
+	stage_function old;
+	stage_function current;
+} bench_stage;
+
+static bench_stage stages[] = {
+	{"blur", oldBlurStage, blurStage},
+	{"filtered_blur", oldFilteredBlurStage, filteredBlurStage},
+	{"sharpen", oldSharpenStage, sharpenStage},
+	{"copy", oldCopyStage, copyStage},
+	{"io", NULL, ioStage},
+};
+#define STAGE_COUNT (sizeof(stages) / sizeof(stages[0]))
+
+typedef struct {
+	double wallMedian;
+	double wallP95;
+	double userMedian;
+} bench_result;
+
+static double wallMs(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static double userMs(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec * 1000.0 + ru.ru_utime.tv_usec / 1000.0;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * measure
+ * runs the stage runs times, each on a fresh copy of pristine (not timed)
+ */
+static bench_result measure(stage_function stage, const char *pristine, unsigned long bytes, int runs) {
+	double *wall = malloc(runs * sizeof(double));
+	double *user = malloc(runs * sizeof(double));
+	bench_result result;
+	int r;
+	for (r = 0; r < runs; ++r) {
+		memcpy(image->data, pristine, bytes);
+		double wallStart = wallMs(), userStart = userMs();
+		stage();
+		wall[r] = wallMs() - wallStart;
+		user[r] = userMs() - userStart;
+	}
+	qsort(wall, runs, sizeof(double), compareDoubles);
+	qsort(user, runs, sizeof(double), compareDoubles);
+	result.wallMedian = wall[runs / 2];
+	result.wallP95 = wall[(int) ceil(0.95 * runs) - 1];
+	result.userMedian = user[runs / 2];
+	free(wall);
+	free(user);
+	return result;
+}
+
+static void report(FILE *out, int json, int *first, int side, const char *stage, const char *impl, int runs,
+		bench_result *result, double speedup) {
+	double mpix = (double) side * side / (result->wallMedian * 1000.0);
+	if (json) {
+		fprintf(out, "%s\n  {\"size\": %d, \"stage\": \"%s\", \"impl\": \"%s\", \"runs\": %d, \"wall_median_ms\": %.3f, "
+				"\"wall_p95_ms\": %.3f, \"user_median_ms\": %.3f, \"mpix_per_s\": %.2f, \"speedup\": ",
+				*first ? "" : ",", side, stage, impl, runs, result->wallMedian, result->wallP95, result->userMedian, mpix);
+		if (speedup > 0) {
+			fprintf(out, "%.2f}", speedup);
+		} else {
+			fprintf(out, "null}");
+		}
+	} else {
+		fprintf(out, "%d,%s,%s,%d,%.3f,%.3f,%.3f,%.2f,", side, stage, impl, runs, result->wallMedian, result->wallP95,
+				result->userMedian, mpix);
+		if (speedup > 0) {
+			fprintf(out, "%.2f", speedup);
+		}
+		fprintf(out, "\n");
+	}
+	*first = 0;
+	fflush(out);
+	printf("%6d^2 %-14s %-7s median %10.3f ms  p95 %10.3f ms  %9.2f Mpix/s", side, stage, impl, result->wallMedian,
+			result->wallP95, mpix);
+	if (speedup > 0) {
+		printf("  x%.2f", speedup);
+	}
+	printf("\n");
+}
+
+/*
+ * makeDirectKernel
+ * the sampled 2D Gaussian of benchSigma out to 3 sigma, in integers scaled so the center is 1024
+ */
+static void makeDirectKernel(void) {
+	int radius = (int) ceil(3 * benchSigma), x, y;
+	directSize = 2 * radius + 1;
+	directScale = 0;
+	directKernel = realloc(directKernel, (size_t) directSize * directSize * sizeof(int));
+	for (y = -radius; y <= radius; ++y) {
+		for (x = -radius; x <= radius; ++x) {
+			int weight = (int) lround(1024 * exp(-(x * x + y * y) / (2 * benchSigma * benchSigma)));
+			directKernel[(y + radius) * directSize + x + radius] = weight;
+			directScale += weight;
+		}
+	}
+}
+
+/*
+ * gaussianBench
+ * doGaussianBlur against the direct 2D Gaussian on one side x side image for each sigma that fits it
+ */
+static void gaussianBench(FILE *out, int json, int *first, int side, const char *pristine, int runs, double maxDirectSigma) {
+	static const double sigmas[] = {1, 2, 4, 8, 16, 32};
+	unsigned long bytes = (unsigned long) side * side * 3;
+	char name[32];
+	unsigned int s;
+	for (s = 0; s < sizeof(sigmas) / sizeof(sigmas[0]); ++s) {
+		benchSigma = sigmas[s];
+		makeDirectKernel();
+		if (directSize > side) {
+			break;
+		}
+		snprintf(name, sizeof(name), "gaussian_s%g", benchSigma);
+		bench_result boxes = measure(gaussianBoxesStage, pristine, bytes, runs);
+		if (benchSigma > maxDirectSigma) {
+			report(out, json, first, side, name, "boxes", runs, &boxes, 0);
+			continue;
+		}
+		char *boxed = malloc(bytes);
+		memcpy(boxed, image->data, bytes);
+		bench_result direct = measure(gaussianDirectStage, pristine, bytes, runs);
+		report(out, json, first, side, name, "direct", runs, &direct, 0);
+		report(out, json, first, side, name, "boxes", runs, &boxes, direct.wallMedian / boxes.wallMedian);
+
+		// both leave a border as it is, the wider one (the direct kernel's 3 sigma) is left out
+		int border = directSize / 2, max = 0, i, j;
+		double total = 0;
+		for (i = border; i < side - border; ++i) {
+			for (j = 3 * border; j < 3 * (side - border); ++j) {
+				int difference = abs((unsigned char) boxed[(size_t) i * 3 * side + j] - (unsigned char) image->data[(size_t) i * 3 * side + j]);
+				total += difference;
+				max = difference > max ? difference : max;
+			}
+		}
+		printf("%6d^2 %-14s boxes vs direct: max difference %d, mean %.3f\n", side, name, max,
+				total / ((double) (side - 2 * border) * (side - 2 * border) * 3));
+		free(boxed);
+	}
+}
+
+int main(int argc, char **argv) {
+	int runs = 5, minSide = 64, maxSide = 16384, maxBaselineSide = 16384, json = 0, first = 1, gaussian = 0, document = 0;
+	double maxDirectSigma = 8;
+	const char *tmpDir = "/tmp", *reportName = NULL;
+	int opt, side;
+	unsigned int s;
+
+	while ((opt = getopt(argc, argv, "r:M:m:b:t:gG:Duf:o:d:")) != -1) {
+		switch (opt) {
+			case 'r': runs = atoi(optarg); break;
+			case 'M': minSide = atoi(optarg); break;
+			case 'm': maxSide = atoi(optarg); break;
+			case 'b': maxBaselineSide = atoi(optarg); break;
+			case 't': smoothThreads = atoi(optarg); break;
+			case 'g': gaussian = 1; break;
+			case 'G': maxDirectSigma = atof(optarg); break;
+			case 'D': document = 1; break;
+			case 'u': skipUniformTiles = true; break;
+			case 'f': json = strcmp(optarg, "json") == 0; break;
+			case 'o': reportName = optarg; break;
+			case 'd': tmpDir = optarg; break;
+			default:
+				printf("usage: %s [-r runs] [-M minSide] [-m maxSide] [-b maxBaselineSide] [-t threads] [-g] [-G maxDirectSigma] [-D] [-u] [-f csv|json] [-o report] [-d tmpdir]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (runs < 1 || minSide < 4) {
+		printf("need at least 1 run and a side of at least 4\n");
+		return 1;
+	}
+	if (reportName == NULL) {
+		reportName = json ? "bench.json" : "bench.csv";
+	}
+	FILE *out = fopen(reportName, "w");
+	if (out == NULL) {
+		printf("Error opening %s\n", reportName);
+		return 1;
+	}
+	if (json) {
+		fprintf(out, "[");
+	} else {
+		fprintf(out, "size,stage,impl,runs,wall_median_ms,wall_p95_ms,user_median_ms,mpix_per_s,speedup\n");
+	}
+
+	snprintf(benchFile, sizeof(benchFile), "%s/bench_%d.bmp", tmpDir, (int) getpid());
+	snprintf(benchOut, sizeof(benchOut), "%s/bench_%d_out.bmp", tmpDir, (int) getpid());
+	Image work;
+	image = &work;
+
+	for (side = minSide & ~3; side <= maxSide; side *= 2) {
+		unsigned long bytes = (unsigned long) side * side * 3;
+		char *pristine = malloc(bytes);
+		work.data = malloc(bytes);
+		if (pristine == NULL || work.data == NULL) {
+			printf("Error allocating memory for %dx%d\n", side, side);
+			return 1;
+		}
+		work.sizeX = work.sizeY = n = m = side;
+		work.bgr = 0;
+		work.mapping = NULL;
+		work.dataMapped = 0;
+		if (document) {
+			synthesizeDocument(pristine, side, side, 0);
+		} else {
+			synthesize(pristine, (unsigned long) side * side, 0);
+		}
+		saveSynthetic(benchFile, pristine, side, side);
+
+		if (gaussian) {
+			gaussianBench(out, json, &first, side, pristine, runs, maxDirectSigma);
+		}
+		for (s = 0; s < STAGE_COUNT && !gaussian; ++s) {
+			bench_result current = measure(stages[s].current, pristine, bytes, runs);
+			if (stages[s].old == NULL) {
+				report(out, json, &first, side, stages[s].name, "shared", runs, &current, 0);
+				continue;
+			}
+			if (side > maxBaselineSide) {
+				report(out, json, &first, side, stages[s].name, "new", runs, &current, 0);
+				continue;
+			}
+			bench_result old = measure(stages[s].old, pristine, bytes, runs);
+			report(out, json, &first, side, stages[s].name, "old", runs, &old, 0);
+			report(out, json, &first, side, stages[s].name, "new", runs, &current, old.wallMedian / current.wallMedian);
+		}
+
+		// the spare buffer of doConvolution stays, it goes when a bigger one is needed
+		free(work.data);
+		free(pristine);
+	}
+	unlink(benchFile);
+	unlink(benchOut);
+	free(directKernel);
+
+	if (json) {
+		fprintf(out, "\n]\n");
+	}
+	fclose(out);
+	printf("report written to %s\n", reportName);
+	return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ *  benchOld.c
+ *
+ *  The original oldmyfunction.c as a baseline for benchBMP. Its global functions are renamed so it links
+ *  next to myfunction.c, which is #included by benchBMP.c; image, n and m are the ones myfunction.c defines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "readBMP.h"
+#include "writeBMP.h"
+
+extern Image *image;
+extern unsigned long n, m;
+
+#define min oldMin
+#define max oldMax
+#define calcIndex oldCalcIndex
+#define initialize_pixel_sum oldInitializePixelSum
+#define smooth oldSmooth
+#define charsToPixels oldCharsToPixels
+#define pixelsToChars oldPixelsToChars
+#define copyPixels oldCopyPixels
+#define doConvolution oldDoConvolution
+#define myfunction oldMyfunction
+#include "oldmyfunction.c"
+
+static int oldBlurKernel[3][3] = {{1, 1, 1}, {1, 1, 1}, {1, 1, 1}};
+static int oldSharpKernel[3][3] = {{-1,-1,-1},{-1,9,-1},{-1,-1,-1}};
+
+// the stages benchBMP times, same calls as the original myfunction makes (square images only, like the original)
+void oldBlurStage(void) {
+	oldDoConvolution(image, 3, oldBlurKernel, 9, false);
+}
+
+void oldFilteredBlurStage(void) {
+	oldDoConvolution(image, 3, oldBlurKernel, 7, true);
+}
+
+void oldSharpenStage(void) {
+	oldDoConvolution(image, 3, oldSharpKernel, 1, false);
+}
+
+void oldCopyStage(void) {
+	pixel *pixels = malloc(m*n*sizeof(pixel));
+	oldCharsToPixels(image, pixels);
+	oldPixelsToChars(pixels, image);
+	free(pixels);
+}
@@ -0,0 +1,196 @@
+/*
+ *  headlessBMP.c
+ *
+ *  Same job as showBMP.c (load, myfunction, write the results) without GLUT/X11,
+ *  for hosts with no display. Takes any number of BMP files and/or directories of BMP files
+ *  in one process. A single image goes through myfunction; several go through myfunctionBatch,
+ *  which loads, smooths and writes them concurrently on one work-stealing pool.
+ *
+ *  usage: headlessBMP <1|2> [-o outdir] [-j threads] <image.bmp | directory>...
+ *  With a single input image the results get the usual names (Blur.bmp, Sharpen.bmp, ...),
+ *  with more they are prefixed with the input's name (gibson_500_Blur.bmp, ...).
+ *  -j sets smoothThreads (default: one thread per core).
+ */
+
+#include <stdio.h>      // Header file for standard file i/o.
+#include <stdlib.h>     // Header file for malloc/free.
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "readBMP.h"
+
+#include "writeBMP.h"
+
+Image *image; // data structure for image
+unsigned long n, m; // width and height
+
+#include "myfunction.c"
+
+/* result names, same as showBMP.c */
+#define RESULT_COUNT 4
+static const char *resultNames[RESULT_COUNT] = {"Blur.bmp", "Sharpen.bmp", "Filtered_Blur.bmp", "Filtered_Sharpen.bmp"};
+
+/* list of input files */
+static char **inputs = NULL;
+static int inputCount = 0, inputCapacity = 0;
+
+static void addInput(const char *path) {
+	if (inputCount == inputCapacity) {
+		inputCapacity = inputCapacity ? 2 * inputCapacity : 16;
+		inputs = realloc(inputs, inputCapacity * sizeof(char *));
+		if (inputs == NULL) {
+			printf("Error allocating memory\n");
+			exit(1);
+		}
+	}
+	inputs[inputCount++] = strdup(path);
+}
+
+static int compareNames(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* adds every *.bmp in the directory, sorted so runs are repeatable */
+static void addDirectory(const char *path) {
+	DIR *dir = opendir(path);
+	struct dirent *entry;
+	int first = inputCount;
+	char file[4096];
+
+	if (dir == NULL) {
+		printf("Can't open directory %s\n", path);
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		size_t length = strlen(entry->d_name);
+		if (length > 4 && strcasecmp(entry->d_name + length - 4, ".bmp") == 0) {
+			snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+			addInput(file);
+		}
+	}
+	closedir(dir);
+	qsort(inputs + first, inputCount - first, sizeof(char *), compareNames);
+}
+
+/* outdir/[stem_]name, malloc'd */
+static char *resultPath(const char *outDir, const char *input, const char *name, int prefixed) {
+	const char *base = strrchr(input, '/');
+	base = base ? base + 1 : input;
+	size_t stem = strlen(base);
+	if (stem > 4 && strcasecmp(base + stem - 4, ".bmp") == 0) {
+		stem -= 4;
+	}
+	if (!prefixed) {
+		stem = 0;
+	}
+	size_t size = strlen(outDir) + stem + strlen(name) + 3;
+	char *path = malloc(size);
+	if (path == NULL) {
+		printf("Error allocating memory\n");
+		exit(1);
+	}
+	if (prefixed) {
+		snprintf(path, size, "%s/%.*s_%s", outDir, (int) stem, base, name);
+	} else {
+		snprintf(path, size, "%s/%s", outDir, name);
+	}
+	return path;
+}
+
+static double seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	const char *outDir = ".";
+	char flag;
+	int i, r, processed = 0;
+	Image loaded;
+	struct stat st;
+
+	if (argc < 3) {
+		printf("usage: %s <1|2> [-o outdir] [-j threads] <image.bmp | directory>...\n", argv[0]);
+		return 1;
+	}
+	flag = argv[1][0];
+	if (flag == '1') {
+		printf("kernel number 1 was chosen\n");
+	}
+	else {
+		printf("kernel number 2 was chosen\n");
+	}
+
+	for (i = 2; i < argc; ++i) {
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			outDir = argv[++i];
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			smoothThreads = atoi(argv[++i]);
+		} else if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+			addDirectory(argv[i]);
+		} else {
+			addInput(argv[i]);
+		}
+	}
+	if (inputCount == 0) {
+		printf("No BMP files found\n");
+		printf("usage: %s <1|2> [-o outdir] [-j threads] <image.bmp | directory>...\n", argv[0]);
+		return 1;
+	}
+
+	// every result name of every input
+	char **results = malloc((size_t) inputCount * RESULT_COUNT * sizeof(char *));
+	if (results == NULL) {
+		printf("Error allocating memory\n");
+		return 1;
+	}
+	for (i = 0; i < inputCount; ++i) {
+		for (r = 0; r < RESULT_COUNT; ++r) {
+			results[i * RESULT_COUNT + r] = resultPath(outDir, inputs[i], resultNames[r], inputCount > 1);
+		}
+	}
+
+	double start = seconds();
+	if (inputCount == 1) {
+		image = &loaded;
+		// bgr straight out of the file mapping, the kernels don't care and writeBMP skips the swap
+		if (ImageLoadBGR(inputs[0], image)) {
+			n = image->sizeX; // width
+			m = image->sizeY; // height
+
+			myfunction(image, inputs[0], results[0], results[1], results[2], results[3], flag);
+
+			ImageFree(image);
+			processed = 1;
+		}
+	} else {
+		batch_item *items = malloc(inputCount * sizeof(batch_item));
+		if (items == NULL) {
+			printf("Error allocating memory\n");
+			return 1;
+		}
+		for (i = 0; i < inputCount; ++i) {
+			char **result = results + i * RESULT_COUNT;
+			items[i] = (batch_item) {inputs[i], result[0], result[1], result[2], result[3]};
+		}
+
+		processed = myfunctionBatch(items, inputCount, flag);
+
+		free(items);
+	}
+	double end = seconds();
+	printf("Processed %d image(s), total runtime: %f ms\n", processed, (end - start) * 1000.0);
+
+	for (i = 0; i < inputCount; ++i) {
+		free(inputs[i]);
+		for (r = 0; r < RESULT_COUNT; ++r) {
+			free(results[i * RESULT_COUNT + r]);
+		}
+	}
+	free(results);
+	free(inputs);
+	return processed == inputCount ? 0 : 1;
+}
@@ -8,8 +8,16 @@
 
 #include <stdio.h>      // Header file for standard file i/o.
 #include <stdlib.h>     // Header file for malloc/free.
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "readBMP.h"
 
+// pshufb for the bgr <-> rgb swap, only built into swapRedBlueSSSE3 and used when the cpu has it
+#include <tmmintrin.h>
+
 /* Simple BMP reading code, should be adaptable to many
  systems. Originally from Windows, ported to Linux, now works on my Mac
  OS system.
@@ -50,84 +58,204 @@ unsigned short int endianReadShort(FILE* file) {
 	return s;
 }
 
-// quick and dirty bitmap loader...for 24 bit bitmaps with 1 plane only.
-// See http://www.dcs.ed.ac.uk/~mxr/gfx/2d/BMP.txt for more info.
-int ImageLoad(char *filename, Image *image) {
-	FILE *file;
-	unsigned long size;                 // size of the image in bytes.
-	unsigned long i;                    // standard counter.
+/* Reads a little endian 32/16 bit integer out of a memory mapped header */
+static unsigned int mappedReadInt(const unsigned char *b) {
+	return (b[3] << 24) | (b[2] << 16) | (b[1] << 8) | b[0];
+}
+
+static unsigned short int mappedReadShort(const unsigned char *b) {
+	return (b[1] << 8) | b[0];
+}
+
+/* Copies one row of pixels, swapping bgr <-> rgb.
+ 16 bytes are loaded at a time but only the first 15 (5 whole pixels) are meant,
+ the 16th byte is overwritten by the next store, so the loop stops one vector early. */
+static __attribute__((target("ssse3"))) unsigned long swapRedBlueSSSE3(unsigned char *dst, const unsigned char *src, unsigned long bytes) {
+	const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+	unsigned long i = 0;
+
+	for (; i + 16 <= bytes; i += 15) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(v, mask));
+	}
+	return i;
+}
+
+/* Without SSSE3 (checked with cpuid) the whole row goes through the byte loop. */
+void swapRedBlue(unsigned char *dst, const unsigned char *src, unsigned long bytes) {
+	unsigned long i = 0;
+	unsigned char temp;
+
+	if (__builtin_cpu_supports("ssse3")) {
+		i = swapRedBlueSSSE3(dst, src, bytes);
+	}
+	for (; i < bytes; i += 3) {
+		temp = src[i];
+		dst[i] = src[i + 2];
+		dst[i + 1] = src[i + 1];
+		dst[i + 2] = temp;
+	}
+}
+
+/* Maps the file and checks the header, returns the mapping or NULL. */
+static unsigned char *mapBMP(char *filename, Image *image, unsigned long *mappedSize, unsigned long *lineBytes) {
+	int fd;
+	struct stat st;
+	unsigned char *map;
 	unsigned short int planes;          // number of planes in image (must be 1)
 	unsigned short int bpp;             // number of bits per pixel (must be 24)
-//	char temp;                // temporary color storage for bgr-rgb conversion. // (USED FOR DEBUGGING IN ORIGINAL CODE)
-	unsigned char temp;                // temporary color storage for bgr-rgb conversion. // (USED FOR DEBUGGING IN ORIGINAL CODE)
 
 	// make sure the file is there.
-	if ((file = fopen(filename, "rb")) == NULL) {
+	if ((fd = open(filename, O_RDONLY)) < 0) {
 		printf("File Not Found : %s\n", filename);
-		return 0;
+		return NULL;
 	}
-
-	// seek through the bmp header, up to the width/height:
-	fseek(file, 18, SEEK_CUR);
+	if (fstat(fd, &st) < 0 || st.st_size < BMP_HEADER_SIZE) {
+		printf("Error reading header from %s.\n", filename);
+		close(fd);
+		return NULL;
+	}
+	// private mapping: writes (see ImageLoadBGR) never reach the file
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Error mapping %s.\n", filename);
+		return NULL;
+	}
+	*mappedSize = st.st_size;
 
 	// read the width
-	if (!(image->sizeX = endianReadInt(file))) {
+	if (!(image->sizeX = mappedReadInt(map + 18))) {
 		printf("Error reading width from %s.\n", filename);
-		return 0;
+		munmap(map, *mappedSize);
+		return NULL;
 	}
 	printf("Width of %s: %lu\n", filename, image->sizeX);
 
 	// read the height
-	if (!(image->sizeY = endianReadInt(file))) {
+	if (!(image->sizeY = mappedReadInt(map + 22))) {
 		printf("Error reading height from %s.\n", filename);
-		return 0;
+		munmap(map, *mappedSize);
+		return NULL;
 	}
 	printf("Height of %s: %lu\n", filename, image->sizeY);
 
-	// calculate the size (assuming 24 bits or 3 bytes per pixel).
-	size = image->sizeX * image->sizeY * 3;
-
 	// read the planes
-	if (!(planes = endianReadShort(file))) {
-		printf("Error reading planes from %s.\n", filename);
-		return 0;
-	}
+	planes = mappedReadShort(map + 26);
 	if (planes != 1) {
 		printf("Planes from %s is not 1: %u\n", filename, planes);
-		return 0;
+		munmap(map, *mappedSize);
+		return NULL;
 	}
 
 	// read the bits per pixel
-	if (!(bpp = endianReadShort(file))) {
-		printf("Error reading bpp from %s.\n", filename);
-		return 0;
-	}
+	bpp = mappedReadShort(map + 28);
 	if (bpp != 24) {
 		printf("Bpp from %s is not 24: %u\n", filename, bpp);
+		munmap(map, *mappedSize);
+		return NULL;
+	}
+
+	// lines are padded to a dword boundary
+	*lineBytes = (image->sizeX * 3 + 3) & ~3UL;
+	if (BMP_HEADER_SIZE + *lineBytes * (image->sizeY - 1) + image->sizeX * 3 > *mappedSize) {
+		printf("Error reading image data from %s.\n", filename);
+		munmap(map, *mappedSize);
+		return NULL;
+	}
+	return map;
+}
+
+// quick and dirty bitmap loader...for 24 bit bitmaps with 1 plane only.
+// See http://www.dcs.ed.ac.uk/~mxr/gfx/2d/BMP.txt for more info.
+// The file is mapped instead of fread into a temporary buffer, and the bgr -> rgb swap is done with pshufb
+// straight from the mapping into the (aligned) image buffer.
+int ImageLoad(char *filename, Image *image) {
+	unsigned long size;                 // size of the image in bytes.
+	unsigned long mappedSize, lineBytes;
+	unsigned long line;
+	unsigned char *map;
+	void *data;
+
+	if ((map = mapBMP(filename, image, &mappedSize, &lineBytes)) == NULL) {
 		return 0;
 	}
 
-	// seek past the rest of the bitmap header.
-	fseek(file, 24, SEEK_CUR);
+	// calculate the size (assuming 24 bits or 3 bytes per pixel).
+	size = image->sizeX * image->sizeY * 3;
 
 	// read the data.
-	image->data = (unsigned char *) malloc(size);
-	if (image->data == NULL) {
+	if (posix_memalign(&data, IMAGE_ALIGN, size)) {
 		printf("Error allocating memory for color-corrected image data");
+		munmap(map, mappedSize);
 		return 0;
 	}
+	image->data = data;
+	image->mapping = NULL;
+	image->mappingSize = 0;
+	image->dataMapped = 0;
+	image->bgr = 0;
 
-	if ((i = fread(image->data, size, 1, file)) != 1) {
-		printf("Error reading image data from %s.\n", filename);
+	for (line = 0; line < image->sizeY; ++line) { // reverse all of the colors. (bgr -> rgb)
+		swapRedBlue((unsigned char *) image->data + line * image->sizeX * 3, map + BMP_HEADER_SIZE + line * lineBytes, image->sizeX * 3);
+	}
+
+	munmap(map, mappedSize);
+	// we're done.
+	return 1;
+}
+
+// Same as ImageLoad but the pixels stay bgr and, when the lines have no padding, stay in the (private) mapping,
+// so loading costs nothing but page faults. The kernels treat the 3 channels the same, so they don't care.
+// Images loaded like this must be released with ImageFree.
+int ImageLoadBGR(char *filename, Image *image) {
+	unsigned long size;
+	unsigned long mappedSize, lineBytes;
+	unsigned long line;
+	unsigned char *map;
+	void *data;
+
+	if ((map = mapBMP(filename, image, &mappedSize, &lineBytes)) == NULL) {
 		return 0;
 	}
+	image->bgr = 1;
+	size = image->sizeX * image->sizeY * 3;
 
-	for (i = 0; i < size; i += 3) { // reverse all of the colors. (bgr -> rgb)
-		temp = image->data[i];
-		image->data[i] = image->data[i + 2];
-		image->data[i + 2] = temp;
+	if (lineBytes == image->sizeX * 3) {
+		image->data = (char *) map + BMP_HEADER_SIZE;
+		image->mapping = map;
+		image->mappingSize = mappedSize;
+		image->dataMapped = 1;
+		return 1;
 	}
 
-	// we're done.
+	// padded lines - copy them together
+	if (posix_memalign(&data, IMAGE_ALIGN, size)) {
+		printf("Error allocating memory for image data");
+		munmap(map, mappedSize);
+		return 0;
+	}
+	image->data = data;
+	image->mapping = NULL;
+	image->mappingSize = 0;
+	image->dataMapped = 0;
+	for (line = 0; line < image->sizeY; ++line) {
+		memcpy(image->data + line * image->sizeX * 3, map + BMP_HEADER_SIZE + line * lineBytes, image->sizeX * 3);
+	}
+	munmap(map, mappedSize);
 	return 1;
 }
+
+// Releases the pixels of an image loaded by ImageLoad or ImageLoadBGR.
+// What to release was decided at load time (dataMapped), not by where data points now.
+void ImageFree(Image *image) {
+	if (!image->dataMapped) {
+		free(image->data);
+	}
+	if (image->mapping != NULL) {
+		munmap(image->mapping, image->mappingSize);
+	}
+	image->data = NULL;
+	image->mapping = NULL;
+	image->dataMapped = 0;
+}
@@ -9,11 +9,24 @@
 #ifndef READ_BMP_H_
 #define READ_BMP_H_
 
-/* Image type - contains height, width, and RGB data */
+/* size of the BMP headers in front of the pixel data */
+#define BMP_HEADER_SIZE 54
+/* alignment of the pixel buffers ImageLoad allocates */
+#define IMAGE_ALIGN 64
+
+/* Image type - contains height, width, and RGB data
+ * Who owns what is fixed at load time: the image owns mapping (if any), and data too unless dataMapped is set,
+ * in which case data is the pixels inside mapping. Kernels working on a mapped image (dataMapped) must not re-point
+ * data, or must put it back before they return: ImageFree unmaps mapping whatever data points to, and a buffer data
+ * was moved to would be leaked (and its owner would be left with the mapping). Write the results into the pixels. */
 struct Image {
 	unsigned long sizeX;
 	unsigned long sizeY;
 	char *data;
+	int bgr;                     /* data is still in file order (ImageLoadBGR) */
+	void *mapping;               /* the file mapping of ImageLoadBGR, if it is kept */
+	unsigned long mappingSize;
+	int dataMapped;              /* data is inside mapping, ImageFree doesn't free it */
 };
 typedef struct Image Image;
 
@@ -29,4 +42,13 @@ typedef struct HSVimage HSVimage;
 /* As side effect, sets w and h */
 int ImageLoad(char* filename, Image* image);
 
+/* Same as ImageLoad but keeps the BGR order and, if possible, the data in a private mapping of the file */
+int ImageLoadBGR(char* filename, Image* image);
+
+/* Releases the data of an image loaded by ImageLoad/ImageLoadBGR: data unless it is mapped, then the mapping */
+void ImageFree(Image* image);
+
+/* Copies bytes of pixels swapping the first and third channel (bgr <-> rgb), dst may be src */
+void swapRedBlue(unsigned char *dst, const unsigned char *src, unsigned long bytes);
+
 #endif /* READ_BMP_H_ */
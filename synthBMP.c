@@ -0,0 +1,122 @@
+/*
+ *  synthBMP.c
+ *
+ *  Synthetic test images for benchBMP and testBMP.
+ */
+
+#include "synthBMP.h"
+#include "readBMP.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * synthesize
+ * random pixels with runs of flat black/white/grey in between, so the uniform-window shortcuts get their share
+ */
+void synthesize(char *data, unsigned long pixels, unsigned long seed) {
+	unsigned long state = 0x9E3779B97F4A7C15UL ^ (seed * 0xBF58476D1CE4E5B9UL + pixels);
+	unsigned long i = 0;
+	while (i < pixels) {
+		state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+		unsigned long run = 1 + (state >> 58);
+		int flat = (state & 7) < 3;
+		unsigned char value = (state >> 8) % 3 == 0 ? 0 : (state >> 8) % 3 == 1 ? 255 : 128;
+		for (; run > 0 && i < pixels; --run, ++i) {
+			if (flat) {
+				data[3*i] = data[3*i + 1] = data[3*i + 2] = value;
+			} else {
+				state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+				data[3*i] = state, data[3*i + 1] = state >> 8, data[3*i + 2] = state >> 16;
+			}
+		}
+	}
+}
+
+/*
+ * synthesizeDocument
+ * a scanned page: paper of one (random, light) colour with a margin of 1/8 of the side all around, and in between
+ * lines of text every 48 rows - 24 rows of words 24 to 152 pixels wide with 16 pixel spaces, every 8th line left
+ * empty between paragraphs. A word is ink pixels of random darkness on about half of its pixels.
+ * About 90% of the pixels are paper, and 2/3 of the 8x32 tiles of skipUniformTiles (myfunction.c) are all paper.
+ */
+void synthesizeDocument(char *data, int width, int height, unsigned long seed) {
+	unsigned long state = 0x9E3779B97F4A7C15UL ^ (seed * 0xBF58476D1CE4E5B9UL + (unsigned long) width * height);
+	unsigned char paper[3];
+	int row, col, c;
+	state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+	for (c = 0; c < 3; ++c) {
+		paper[c] = 224 + ((state >> (8 * c)) & 31);
+	}
+	for (row = 0; row < height; ++row) {
+		for (col = 0; col < width; ++col) {
+			memcpy(data + 3 * ((size_t) row * width + col), paper, 3);
+		}
+	}
+	int left = width / 8, right = width - width / 8, top = height / 8, bottom = height - height / 8;
+	int line;
+	for (line = 0; top + 48 * line + 24 <= bottom; ++line) {
+		if (line % 8 == 7) {
+			continue;
+		}
+		int word = left;
+		while (word < right) {
+			state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+			int end = word + 24 + (int) (state >> 57);
+			end = end < right ? end : right;
+			for (row = top + 48 * line; row < top + 48 * line + 24; ++row) {
+				for (col = word; col < end; ++col) {
+					state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+					if (state & 1) {
+						unsigned char ink = (state >> 8) & 127;
+						memset(data + 3 * ((size_t) row * width + col), ink, 3);
+					}
+				}
+			}
+			word = end + 16;
+		}
+	}
+}
+
+static void putInt(unsigned char *p, unsigned int v) {
+	p[0] = v, p[1] = v >> 8, p[2] = v >> 16, p[3] = v >> 24;
+}
+
+static void putShort(unsigned char *p, unsigned short v) {
+	p[0] = v, p[1] = v >> 8;
+}
+
+void saveSynthetic(const char *fileName, const char *data, int width, int height) {
+	unsigned char header[BMP_HEADER_SIZE] = {'B', 'M'};
+	static const char padding[4] = {0};
+	unsigned long pixelBytes = (unsigned long) width * 3;
+	unsigned long lineBytes = (pixelBytes + 3) & ~3UL;
+	int line;
+	FILE *file = fopen(fileName, "wb");
+	if (file == NULL) {
+		printf("Error opening %s\n", fileName);
+		exit(1);
+	}
+	putInt(header + 2, BMP_HEADER_SIZE + lineBytes * height);
+	putInt(header + 10, BMP_HEADER_SIZE);
+	putInt(header + 14, 40);
+	putInt(header + 18, width);
+	putInt(header + 22, height);
+	putShort(header + 26, 1);
+	putShort(header + 28, 24);
+	putInt(header + 34, lineBytes * height);
+	putInt(header + 38, 2835);
+	putInt(header + 42, 2835);
+	if (fwrite(header, 1, BMP_HEADER_SIZE, file) != BMP_HEADER_SIZE) {
+		printf("Error writing %s\n", fileName);
+		exit(1);
+	}
+	for (line = 0; line < height; ++line) {
+		if (fwrite(data + line * pixelBytes, 1, pixelBytes, file) != pixelBytes
+				|| fwrite(padding, 1, lineBytes - pixelBytes, file) != lineBytes - pixelBytes) {
+			printf("Error writing %s\n", fileName);
+			exit(1);
+		}
+	}
+	fclose(file);
+}
@@ -0,0 +1,13 @@
+#ifndef SYNTH_BMP_H_
+#define SYNTH_BMP_H_
+
+/* Fills pixels*3 bytes with random pixels and runs of flat black/white/grey (same seed -> same image) */
+void synthesize(char *data, unsigned long pixels, unsigned long seed);
+
+/* Fills width x height pixels with a page: flat paper colour, margins, and lines of words of random ink (same seed -> same image) */
+void synthesizeDocument(char *data, int width, int height, unsigned long seed);
+
+/* Saves width x height pixels (unpadded lines) as a 24 bit BMP, exits on failure */
+void saveSynthetic(const char *fileName, const char *data, int width, int height);
+
+#endif /* SYNTH_BMP_H_ */
@@ -0,0 +1,1059 @@
+/*
+ *  testBMP.c
+ *
+ *  Golden-image and performance regression suite.
+ *  Correctness: every variant of myfunction (simd, scalar, threaded, fused, in place, planar, bgr loading, batch, tiled,
+ *  uniform tile skipping, and the kernels of each instruction set the cpu has - a set it doesn't have falls back to the
+ *  best it does) runs on gibson_500.bmp, on random square images and on synthetic pages of mostly flat paper, and each
+ *  result file has to be byte for byte the one oldmyfunction.c (linked in through benchOld.c) writes for the same input. For gibson_500 the baseline itself
+ *  is first checked against the shipped *_correct.bmp files.
+ *  Kernels: doConvolution with the kernels of myfunction and others (3x3 up to 7x7, with and without the filter) in
+ *  every variant, on square images and ones that aren't, against a plain per-pixel convolution, which itself is checked
+ *  against oldmyfunction.c for the 3x3 ones on the square images.
+ *  Boxes: doBoxBlur with radii up to 50 (and a box with window sums past 2^31) on images that aren't square, in every
+ *  variant against a plain per-pixel box.
+ *  Gaussians: doGaussianBlur for sigmas up to 20 in every variant against its six box passes done one pixel at a time,
+ *  and the box sizes picked for every sigma from 1 to 40 against the sigma they are for.
+ *  Mappings: a single pass on an image loaded into its file mapping, released, then more passes on new images.
+ *  Headers: writeBMP with other images saved under the same original file name.
+ *  Planes: planarReserve when the planes can't be allocated, and myfunction when they can't for the blur only.
+ *  Reciprocals: the multiply-shift division of myfunction.c against C division, exhaustively for every scale over
+ *  [-2295, 2295] and for each test kernel over the whole range of its sums.
+ *  Performance: every variant runs on a synthetic PERF_SIDE x PERF_SIDE image, taking turns with the copy variant, and
+ *  fails if its median throughput relative to the copy one is below (1 - tolerance) of the ratio recorded in the baseline
+ *  file. Ratios rather than Mpix/s so that a slower (or busier) host than the one that recorded them still passes.
+ *
+ *  usage: testBMP [-c] [-p] [-R] [-b baseline] [-t tolerance] [-d tmpdir]
+ *  -c correctness only, -p performance only, -R records the baseline file instead of checking against it.
+ *  Exit status is the number of failures (capped at 255).
+ */
+
+#include <stdio.h>      // Header file for standard file i/o.
+#include <stdlib.h>     // Header file for malloc/free.
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <immintrin.h>  // before the posix_memalign hook, mm_malloc.h declares it
+#include "readBMP.h"
+#include "synthBMP.h"
+
+#include "writeBMP.h"
+
+Image *image; // data structure for image
+unsigned long n, m; // width and height
+
+// the next failAlignedAllocations aligned allocations of myfunction.c fail (see planarFallbackChecks)
+static int failAlignedAllocations = 0;
+
+static int failingPosixMemalign(void **memory, size_t alignment, size_t size) {
+	if (failAlignedAllocations > 0) {
+		--failAlignedAllocations;
+		return ENOMEM;
+	}
+	return posix_memalign(memory, alignment, size);
+}
+
+#define posix_memalign failingPosixMemalign
+#include "myfunction.c"
+#undef posix_memalign
+
+// the original myfunction and doConvolution, see benchOld.c
+void oldMyfunction(Image *image, char* srcImgpName, char* blurRsltImgName, char* sharpRsltImgName, char* filteredBlurRsltImgName, char* filteredSharpRsltImgName, char flag);
+void oldDoConvolution(Image *image, int kernelSize, int kernel[kernelSize][kernelSize], int kernelScale, bool filter);
+
+#define RESULT_COUNT 4
+static const char *resultNames[RESULT_COUNT] = {"Blur.bmp", "Sharpen.bmp", "Filtered_Blur.bmp", "Filtered_Sharpen.bmp"};
+
+// random inputs: odd sides for padded lines, tiny ones for the border cases, one big enough for bands
+static const int randomSides[] = {3, 4, 5, 17, 64, 127, 333, 1031};
+#define RANDOM_COUNT (sizeof(randomSides) / sizeof(randomSides[0]))
+// synthetic pages, mostly flat paper (see synthesizeDocument)
+static const int documentSides[] = {64, 333, 1031};
+#define DOCUMENT_COUNT (sizeof(documentSides) / sizeof(documentSides[0]))
+
+// kernels for doConvolution besides the two of myfunction: fixed ones (see fixedKernels), generic ones, filtered ones
+#define MAX_TEST_KERNEL 7
+typedef struct {
+	const char *name;
+	int size;
+	int weights[MAX_TEST_KERNEL*MAX_TEST_KERNEL];
+	int scale;
+	bool filter;
+} test_kernel;
+
+static test_kernel testKernels[] = {
+	// the passes of myfunction, which doConvolution hands to the same blur and sharpen code
+	{"blur3", 3, {1, 1, 1, 1, 1, 1, 1, 1, 1}, 9, false},
+	{"blur3_filtered", 3, {1, 1, 1, 1, 1, 1, 1, 1, 1}, 7, true},
+	{"sharpen3", 3, {-1, -1, -1, -1, 9, -1, -1, -1, -1}, 1, false},
+	{"gaussian3", 3, {1, 2, 1, 2, 4, 2, 1, 2, 1}, 16, false},
+	{"gaussian3_filtered", 3, {1, 2, 1, 2, 4, 2, 1, 2, 1}, 14, true},
+	{"blur3_scale9_filtered", 3, {1, 1, 1, 1, 1, 1, 1, 1, 1}, 9, true},
+	{"sharpen3_filtered", 3, {-1, -1, -1, -1, 9, -1, -1, -1, -1}, 1, true},
+	{"edge3", 3, {0, -1, 0, -1, 4, -1, 0, -1, 0}, 1, false},
+	{"mixed3_negative_scale", 3, {3, -2, 5, -1, 7, 0, 2, -4, 1}, -5, false},
+	{"box5", 5, {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}, 25, false},
+	{"box5_filtered", 5, {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}, 23, true},
+	{"gaussian5", 5, {1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6, 4, 16, 24, 16, 4, 1, 4, 6, 4, 1}, 256, false},
+	{"box7_scale40", 7, {[0 ... 48] = 1}, 40, false},
+	{"box5_negative_weight_scale", 5, {[0 ... 24] = -3}, -70, false},
+	{"mixed7_filtered", 7, {0}, 9, true},     // weights filled in by fillMixedKernel
+};
+#define TEST_KERNEL_COUNT (sizeof(testKernels) / sizeof(testKernels[0]))
+// kernels are checked on these width x height, a few smaller than the kernels and some not square
+static const int kernelSides[][2] = {
+	{3, 3}, {4, 4}, {6, 6}, {9, 9}, {17, 17}, {64, 64}, {127, 127}, {333, 333},
+	{3, 17}, {17, 4}, {64, 9}, {33, 131}, {200, 71},
+};
+#define KERNEL_SIDE_COUNT (sizeof(kernelSides) / sizeof(kernelSides[0]))
+
+// big box blurs (see boxChecks): doBoxBlur, or doConvolution with a size x size kernel of weight when weight isn't 1
+typedef struct {
+	int width;
+	int height;
+	int radius;
+	int weight;
+	int scale;
+} test_box;
+
+static const test_box testBoxes[] = {
+	{64, 48, 5, 1, 121},
+	{97, 211, 20, 1, 840},          // clamps at 255
+	{160, 130, 50, 1, 10201},
+	{40, 30, 30, 1, 1},             // doesn't fit, the image stays as it is
+	{150, 120, 50, 1000, 9000000},  // window sums past 2^31
+	{33, 45, 8, -2, -300},
+};
+#define TEST_BOX_COUNT (sizeof(testBoxes) / sizeof(testBoxes[0]))
+
+// Gaussian blurs (see gaussianChecks)
+typedef struct {
+	int width;
+	int height;
+	double sigma;
+} test_gaussian;
+
+static const test_gaussian testGaussians[] = {
+	{64, 48, 1.0},
+	{97, 211, 2.5},
+	{160, 130, 8.0},
+	{300, 90, 13.7},
+	{40, 30, 20.0},                 // doesn't fit, the image stays as it is
+	{33, 45, 0.5},                  // three boxes of 1, nothing to blur
+};
+#define TEST_GAUSSIAN_COUNT (sizeof(testGaussians) / sizeof(testGaussians[0]))
+
+// side of the synthetic image the throughput is measured on, and runs per measurement
+#define PERF_SIDE 1024
+#define PERF_RUNS 5
+
+typedef struct {
+	const char *name;
+	void (*setup)(void);
+	bool bgr;            // load with ImageLoadBGR
+	bool batch;          // run through myfunctionBatch
+} test_variant;
+
+// back to the defaults of myfunction.c
+static void resetFlags(void) {
+	slidingWindowBlur = true;
+	simdSharpen = true;
+	simdFilteredBlur = true;
+	fusedPipeline = false;
+	zeroCopyConvolution = true;
+	inPlaceConvolution = false;
+	planarConvolution = false;
+	asyncWrites = true;
+	tiledExecution = false;
+	tileRows = 0;
+	tileCols = 0;
+	skipUniformTiles = false;
+	selectKernels(ISA_AUTO);
+	// a changed thread count only takes with a new pool
+	stopSmoothPool();
+	smoothThreads = 0;
+}
+
+static void simdSetup(void) {
+}
+
+static void scalarSetup(void) {
+	slidingWindowBlur = false;
+	simdSharpen = false;
+	simdFilteredBlur = false;
+	asyncWrites = false;
+	smoothThreads = 1;
+}
+
+// more threads than cores is fine, it's the banding that's being tested
+static void threadedSetup(void) {
+	smoothThreads = 4;
+}
+
+static void fusedSetup(void) {
+	fusedPipeline = true;
+}
+
+static void inPlaceSetup(void) {
+	inPlaceConvolution = true;
+}
+
+static void planarSetup(void) {
+	planarConvolution = true;
+	smoothThreads = 4;
+}
+
+static void legacyCopySetup(void) {
+	zeroCopyConvolution = false;
+}
+
+static void sse2Setup(void) {
+	selectKernels(ISA_SSE2);
+}
+
+static void avx2Setup(void) {
+	selectKernels(ISA_AVX2);
+}
+
+static void avx512Setup(void) {
+	selectKernels(ISA_AVX512);
+}
+
+static void planarSSE2Setup(void) {
+	planarSetup();
+	selectKernels(ISA_SSE2);
+}
+
+// small odd tiles so most pixels are near a tile edge, the halos are what's being tested
+static void tiledSetup(void) {
+	tiledExecution = true;
+	tileRows = 7;
+	tileCols = 13;
+	smoothThreads = 4;
+}
+
+static void tiledFusedSetup(void) {
+	tiledSetup();
+	fusedPipeline = true;
+}
+
+// tile size from the caches
+static void tiledAutoSetup(void) {
+	tiledExecution = true;
+}
+
+static void uniformSetup(void) {
+	skipUniformTiles = true;
+	smoothThreads = 4;
+}
+
+static void uniformFusedSetup(void) {
+	uniformSetup();
+	fusedPipeline = true;
+}
+
+static test_variant variants[] = {
+	{"simd", simdSetup, false, false},
+	{"scalar", scalarSetup, false, false},
+	{"threaded", threadedSetup, false, false},
+	{"fused", fusedSetup, false, false},
+	{"inplace", inPlaceSetup, false, false},
+	{"planar", planarSetup, false, false},
+	{"copy", legacyCopySetup, false, false},
+	{"bgr", simdSetup, true, false},
+	{"batch", threadedSetup, true, true},
+	{"sse2", sse2Setup, false, false},
+	{"avx2", avx2Setup, false, false},
+	{"avx512", avx512Setup, false, false},
+	{"planar_sse2", planarSSE2Setup, false, false},
+	{"tiled", tiledSetup, false, false},
+	{"tiled_fused", tiledFusedSetup, false, false},
+	{"tiled_auto", tiledAutoSetup, false, false},
+	{"uniform", uniformSetup, false, false},
+	{"uniform_fused", uniformFusedSetup, false, false},
+};
+#define VARIANT_COUNT (sizeof(variants) / sizeof(variants[0]))
+
+static char tmpDir[4096];
+static int failures = 0;
+
+static void tmpPath(char *buffer, size_t size, const char *prefix, const char *name) {
+	snprintf(buffer, size, "%s/%s%s", tmpDir, prefix, name);
+}
+
+static bool sameFiles(const char *a, const char *b) {
+	FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+	bool same = fa != NULL && fb != NULL;
+	char ba[65536], bb[65536];
+	while (same) {
+		size_t ra = fread(ba, 1, sizeof(ba), fa), rb = fread(bb, 1, sizeof(bb), fb);
+		if (ra != rb || memcmp(ba, bb, ra) != 0) {
+			same = false;
+		}
+		if (ra == 0) {
+			break;
+		}
+	}
+	if (fa != NULL) {
+		fclose(fa);
+	}
+	if (fb != NULL) {
+		fclose(fb);
+	}
+	return same;
+}
+
+static void check(bool ok, const char *what, const char *input, char flag) {
+	printf("%s %s %s flag %c\n", ok ? "PASS" : "FAIL", what, input, flag);
+	if (!ok) {
+		++failures;
+	}
+}
+
+/*
+ * runVariant
+ * the results of input for flag with the given variant go to tmpDir/<prefix><result name>
+ */
+static void runVariant(test_variant *variant, char *input, char flag, const char *prefix) {
+	char results[RESULT_COUNT][4096];
+	Image loaded;
+	int r;
+	for (r = 0; r < RESULT_COUNT; ++r) {
+		tmpPath(results[r], sizeof(results[r]), prefix, resultNames[r]);
+	}
+	resetFlags();
+	variant->setup();
+
+	if (variant->batch) {
+		batch_item item = {input, results[0], results[1], results[2], results[3]};
+		if (myfunctionBatch(&item, 1, flag) != 1) {
+			exit(1);
+		}
+		return;
+	}
+	if (!(variant->bgr ? ImageLoadBGR(input, &loaded) : ImageLoad(input, &loaded))) {
+		exit(1);
+	}
+	image = &loaded;
+	n = loaded.sizeX;
+	m = loaded.sizeY;
+	myfunction(&loaded, input, results[0], results[1], results[2], results[3], flag);
+	ImageFree(&loaded);
+}
+
+// the two results of flag
+static int firstResult(char flag) {
+	return flag == '1' ? 0 : 2;
+}
+
+/*
+ * checkInput
+ * the baseline results of input, then every variant against them
+ */
+static void checkInput(char *input, bool golden) {
+	char reference[4096], result[4096], name[4200];
+	const char *flags = "12";
+	unsigned int v;
+	int f, r;
+	for (f = 0; f < 2; ++f) {
+		char flag = flags[f];
+		Image loaded;
+		char results[RESULT_COUNT][4096];
+		for (r = 0; r < RESULT_COUNT; ++r) {
+			tmpPath(results[r], sizeof(results[r]), "old_", resultNames[r]);
+		}
+		if (!ImageLoad(input, &loaded)) {
+			exit(1);
+		}
+		image = &loaded;
+		n = loaded.sizeX;
+		m = loaded.sizeY;
+		oldMyfunction(&loaded, input, results[0], results[1], results[2], results[3], flag);
+		ImageFree(&loaded);
+
+		if (golden) {
+			for (r = firstResult(flag); r < firstResult(flag) + 2; ++r) {
+				char correct[4096];
+				snprintf(correct, sizeof(correct), "%.*s_correct.bmp", (int) strlen(resultNames[r]) - 4, resultNames[r]);
+				snprintf(name, sizeof(name), "baseline %s", correct);
+				check(sameFiles(results[r], correct), name, input, flag);
+			}
+		}
+
+		for (v = 0; v < VARIANT_COUNT; ++v) {
+			runVariant(&variants[v], input, flag, "new_");
+			for (r = firstResult(flag); r < firstResult(flag) + 2; ++r) {
+				tmpPath(reference, sizeof(reference), "old_", resultNames[r]);
+				tmpPath(result, sizeof(result), "new_", resultNames[r]);
+				snprintf(name, sizeof(name), "%s %s", variants[v].name, resultNames[r]);
+				check(sameFiles(reference, result), name, input, flag);
+			}
+		}
+	}
+}
+
+static void correctness(void) {
+	char input[4096];
+	unsigned int i;
+	checkInput("gibson_500.bmp", true);
+	for (i = 0; i < RANDOM_COUNT; ++i) {
+		int side = randomSides[i];
+		char *data = malloc((unsigned long) side * side * 3);
+		synthesize(data, (unsigned long) side * side, i + 1);
+		snprintf(input, sizeof(input), "%s/random_%d.bmp", tmpDir, side);
+		saveSynthetic(input, data, side, side);
+		free(data);
+		checkInput(input, false);
+		unlink(input);
+	}
+	for (i = 0; i < DOCUMENT_COUNT; ++i) {
+		int side = documentSides[i];
+		char *data = malloc((unsigned long) side * side * 3);
+		synthesizeDocument(data, side, side, i + 1);
+		snprintf(input, sizeof(input), "%s/document_%d.bmp", tmpDir, side);
+		saveSynthetic(input, data, side, side);
+		free(data);
+		checkInput(input, false);
+		unlink(input);
+	}
+}
+
+static void fillMixedKernel(test_kernel *kernel) {
+	int i, count = kernel->size * kernel->size;
+	for (i = 0; i < count; ++i) {
+		kernel->weights[i] = (i * 7 + 3) % 7 - 3;
+	}
+	kernel->weights[count / 2] = 12;
+}
+
+/*
+ * referenceConvolution
+ * the original applyKernel for a size x size window, one pixel at a time, border pixels stay as they are
+ */
+static void referenceConvolution(pixel *src, pixel *dst, int width, int height, test_kernel *kernel) {
+	int radius = kernel->size / 2;
+	int i, j, y, x;
+	memcpy(dst, src, (size_t) width * height * sizeof(pixel));
+	for (i = radius; i < height - radius; ++i) {
+		for (j = radius; j < width - radius; ++j) {
+			int sum[3] = {0, 0, 0}, minIntensity = 766, maxIntensity = -1;
+			pixel *minPixel = NULL, *maxPixel = NULL;
+			for (y = -radius; y <= radius; ++y) {
+				for (x = -radius; x <= radius; ++x) {
+					pixel *p = &src[(i + y) * width + j + x];
+					int weight = kernel->weights[(y + radius) * kernel->size + x + radius];
+					int intensity = p->red + p->green + p->blue;
+					sum[0] += weight * p->red;
+					sum[1] += weight * p->green;
+					sum[2] += weight * p->blue;
+					if (intensity <= minIntensity) {
+						minIntensity = intensity;
+						minPixel = p;
+					}
+					if (intensity > maxIntensity) {
+						maxIntensity = intensity;
+						maxPixel = p;
+					}
+				}
+			}
+			if (kernel->filter) {
+				sum[0] -= minPixel->red + maxPixel->red;
+				sum[1] -= minPixel->green + maxPixel->green;
+				sum[2] -= minPixel->blue + maxPixel->blue;
+			}
+			for (x = 0; x < 3; ++x) {
+				int value = sum[x] / kernel->scale;
+				((unsigned char *) &dst[i * width + j])[x] = value < 0 ? 0 : value > 255 ? 255 : value;
+			}
+		}
+	}
+}
+
+// work (and image, n and m) set up on a malloced copy of the width x height pristine, for a pass to run on
+static void workingCopy(Image *work, const char *pristine, int width, int height) {
+	size_t bytes = (size_t) width * height * 3;
+	work->data = malloc(bytes);
+	memcpy(work->data, pristine, bytes);
+	work->sizeX = n = width;
+	work->sizeY = m = height;
+	work->bgr = 0;
+	work->mapping = NULL;
+	work->dataMapped = 0;
+	image = work;
+}
+
+static void kernelChecks(void) {
+	char name[256], input[64];
+	unsigned int k, i, v;
+	fillMixedKernel(&testKernels[TEST_KERNEL_COUNT - 1]);
+	for (i = 0; i < KERNEL_SIDE_COUNT; ++i) {
+		int width = kernelSides[i][0], height = kernelSides[i][1];
+		size_t bytes = (size_t) width * height * 3;
+		char *pristine = malloc(bytes);
+		pixel *expected = malloc(bytes);
+		synthesize(pristine, (unsigned long) width * height, 100 + i);
+		snprintf(input, sizeof(input), "random %dx%d", width, height);
+
+		for (k = 0; k < TEST_KERNEL_COUNT; ++k) {
+			test_kernel *kernel = &testKernels[k];
+			Image work;
+			referenceConvolution((pixel *) pristine, expected, width, height, kernel);
+			// the original smooth only does square images
+			if (kernel->size == 3 && width == height) {
+				work.data = malloc(bytes);
+				memcpy(work.data, pristine, bytes);
+				image = &work;
+				n = m = width;
+				oldDoConvolution(&work, 3, (int (*)[3]) kernel->weights, kernel->scale, kernel->filter);
+				snprintf(name, sizeof(name), "reference %s", kernel->name);
+				check(memcmp(work.data, expected, bytes) == 0, name, input, '-');
+				free(work.data);
+			}
+			for (v = 0; v < VARIANT_COUNT; ++v) {
+				if (variants[v].batch) {
+					continue;
+				}
+				resetFlags();
+				variants[v].setup();
+				workingCopy(&work, pristine, width, height);
+				doConvolution(&work, kernel->size, (int (*)[kernel->size]) kernel->weights, kernel->scale, kernel->filter);
+				snprintf(name, sizeof(name), "%s %s", variants[v].name, kernel->name);
+				check(memcmp(work.data, expected, bytes) == 0, name, input, '-');
+				free(work.data);
+			}
+		}
+		free(pristine);
+		free(expected);
+	}
+	resetFlags();
+}
+
+/*
+ * referenceBox
+ * referenceConvolution for a (2*radius+1)^2 box of weight on any width x height, with 64 bit sums
+ */
+static void referenceBox(pixel *src, pixel *dst, const test_box *box) {
+	int width = box->width, height = box->height, radius = box->radius;
+	int i, j, y, x, c;
+	memcpy(dst, src, (size_t) width * height * sizeof(pixel));
+	for (i = radius; i < height - radius; ++i) {
+		for (j = radius; j < width - radius; ++j) {
+			long long sum[3] = {0, 0, 0};
+			for (y = -radius; y <= radius; ++y) {
+				for (x = -radius; x <= radius; ++x) {
+					pixel *p = &src[(i + y) * width + j + x];
+					sum[0] += p->red;
+					sum[1] += p->green;
+					sum[2] += p->blue;
+				}
+			}
+			for (c = 0; c < 3; ++c) {
+				long long value = box->weight * sum[c] / box->scale;
+				((unsigned char *) &dst[i * width + j])[c] = value < 0 ? 0 : value > 255 ? 255 : value;
+			}
+		}
+	}
+}
+
+/*
+ * boxChecks
+ * radii past the test kernels (up to 50) on images that aren't square, in every variant but batch
+ */
+static void boxChecks(void) {
+	char name[256], input[64];
+	unsigned int b, v;
+	int i;
+	for (b = 0; b < TEST_BOX_COUNT; ++b) {
+		const test_box *box = &testBoxes[b];
+		int size = 2 * box->radius + 1;
+		size_t bytes = (size_t) box->width * box->height * 3;
+		char *pristine = malloc(bytes);
+		pixel *expected = malloc(bytes);
+		int *kernel = malloc((size_t) size * size * sizeof(int));
+		for (i = 0; i < size * size; ++i) {
+			kernel[i] = box->weight;
+		}
+		synthesize(pristine, (unsigned long) box->width * box->height, 200 + b);
+		referenceBox((pixel *) pristine, expected, box);
+		snprintf(input, sizeof(input), "random %dx%d", box->width, box->height);
+
+		for (v = 0; v < VARIANT_COUNT; ++v) {
+			Image work;
+			if (variants[v].batch) {
+				continue;
+			}
+			resetFlags();
+			variants[v].setup();
+			workingCopy(&work, pristine, box->width, box->height);
+			if (box->weight == 1) {
+				doBoxBlur(&work, box->radius, box->scale);
+			} else {
+				doConvolution(&work, size, (int (*)[size]) kernel, box->scale, false);
+			}
+			snprintf(name, sizeof(name), "%s box radius %d weight %d scale %d", variants[v].name, box->radius, box->weight, box->scale);
+			check(memcmp(work.data, expected, bytes) == 0, name, input, '-');
+			free(work.data);
+		}
+		free(kernel);
+		free(pristine);
+		free(expected);
+	}
+	resetFlags();
+}
+
+/*
+ * referenceGaussian
+ * the six box passes of doGaussianBlur one after the other over the whole image, each pixel summed on its own,
+ * with the same 8.8 fixed point and rounding; the box radii are the ones describeGaussian picks
+ */
+static void referenceGaussian(pixel *src, pixel *dst, const test_gaussian *gaussian) {
+	int width = gaussian->width, height = gaussian->height;
+	convolution conv = describeGaussian(gaussian->sigma);
+	int radius = conv.radius, done = 0;
+	size_t count = (size_t) width * height * 3;
+	int *values = malloc(count * sizeof(int)), *passed = malloc(count * sizeof(int));
+	int i, j, d, c, p;
+	memcpy(dst, src, count);
+	if (width < conv.size || height < conv.size) {
+		free(values);
+		free(passed);
+		return;
+	}
+	for (i = 0; i < (int) count; ++i) {
+		values[i] = ((unsigned char *) src)[i] << 8;
+	}
+	// along the rows, then down the columns
+	for (p = 0; p < 6; ++p) {
+		int r = conv.boxRadii[p % 3];
+		done = p % 3 == 0 ? r : done + r;
+		memcpy(passed, values, count * sizeof(int));
+		for (i = p < 3 ? 0 : done; i < (p < 3 ? height : height - done); ++i) {
+			for (j = p < 3 ? done : radius; j < (p < 3 ? width - done : width - radius); ++j) {
+				for (c = 0; c < 3; ++c) {
+					int sum = 0;
+					for (d = -r; d <= r; ++d) {
+						sum += p < 3 ? values[(i * width + j + d) * 3 + c] : values[((i + d) * width + j) * 3 + c];
+					}
+					passed[(i * width + j) * 3 + c] = (sum + r) / (2 * r + 1);
+				}
+			}
+		}
+		memcpy(values, passed, count * sizeof(int));
+	}
+	for (i = radius; i < height - radius; ++i) {
+		for (j = radius; j < width - radius; ++j) {
+			for (c = 0; c < 3; ++c) {
+				((unsigned char *) &dst[i * width + j])[c] = (values[(i * width + j) * 3 + c] + 128) >> 8;
+			}
+		}
+	}
+	free(values);
+	free(passed);
+}
+
+/*
+ * gaussianChecks
+ * doGaussianBlur in every variant but batch against referenceGaussian, and the box sizes describeGaussian picks
+ * against sigma: the three boxes' variances have to add up to within 0.2 of sigma for every sigma from 1 to 40
+ */
+static void gaussianChecks(void) {
+	char name[256], input[64];
+	unsigned int g, v;
+	int s, i;
+	double worst = 0, worstSigma = 0;
+	for (s = 10; s <= 400; ++s) {
+		convolution conv = describeGaussian(s / 10.0);
+		double variance = 0;
+		for (i = 0; i < 3; ++i) {
+			int boxWidth = 2 * conv.boxRadii[i] + 1;
+			variance += (boxWidth * boxWidth - 1) / 12.0;
+		}
+		if (fabs(sqrt(variance) - s / 10.0) > worst) {
+			worst = fabs(sqrt(variance) - s / 10.0);
+			worstSigma = s / 10.0;
+		}
+	}
+	snprintf(name, sizeof(name), "Gaussian boxes for sigma 1 to 40 (worst off by %.3f at sigma %.1f)", worst, worstSigma);
+	check(worst <= 0.2, name, "-", '-');
+	for (g = 0; g < TEST_GAUSSIAN_COUNT; ++g) {
+		const test_gaussian *gaussian = &testGaussians[g];
+		size_t bytes = (size_t) gaussian->width * gaussian->height * 3;
+		char *pristine = malloc(bytes);
+		pixel *expected = malloc(bytes);
+		synthesize(pristine, (unsigned long) gaussian->width * gaussian->height, 300 + g);
+		referenceGaussian((pixel *) pristine, expected, gaussian);
+		snprintf(input, sizeof(input), "random %dx%d", gaussian->width, gaussian->height);
+
+		for (v = 0; v < VARIANT_COUNT; ++v) {
+			Image work;
+			if (variants[v].batch) {
+				continue;
+			}
+			resetFlags();
+			variants[v].setup();
+			workingCopy(&work, pristine, gaussian->width, gaussian->height);
+			doGaussianBlur(&work, gaussian->sigma);
+			snprintf(name, sizeof(name), "%s Gaussian sigma %.1f", variants[v].name, gaussian->sigma);
+			check(memcmp(work.data, expected, bytes) == 0, name, input, '-');
+			free(work.data);
+		}
+		free(pristine);
+		free(expected);
+	}
+	resetFlags();
+}
+
+/*
+ * blurGibson
+ * doBoxBlur on gibson_500.bmp loaded with load, the result in a buffer of its own; the image is released with ImageFree
+ */
+static char *blurGibson(int (*load)(char *, Image *), bool zeroCopy, bool *mapped) {
+	Image loaded;
+	char *result;
+	if (!load("gibson_500.bmp", &loaded)) {
+		exit(1);
+	}
+	image = &loaded;
+	n = loaded.sizeX;
+	m = loaded.sizeY;
+	zeroCopyConvolution = zeroCopy;
+	if (mapped != NULL) {
+		*mapped = loaded.dataMapped && loaded.data == (char *) loaded.mapping + BMP_HEADER_SIZE;
+	}
+	doBoxBlur(&loaded, 5, 121);
+	if (mapped != NULL) {
+		*mapped = *mapped && loaded.data == (char *) loaded.mapping + BMP_HEADER_SIZE;
+	}
+	result = malloc(n * m * 3);
+	memcpy(result, loaded.data, n * m * 3);
+	ImageFree(&loaded);
+	zeroCopyConvolution = true;
+	return result;
+}
+
+/*
+ * mappingChecks
+ * a single pass on an image that is still the file mapping (ImageLoadBGR, gibson_500 has no padding) has to leave it
+ * in image->data: ImageFree unmaps it, and the next convolution (on a new buffer, or on the next mapping, which the
+ * kernel likes to put at the same address) must neither touch it nor read it as its spare buffer
+ */
+static void mappingChecks(void) {
+	bool mapped;
+	resetFlags();
+	char *first = blurGibson(ImageLoadBGR, true, &mapped);
+	check(mapped, "single pass keeps the file mapping in image->data", "gibson_500.bmp", '-');
+	char *copied = blurGibson(ImageLoad, false, NULL);
+	char *zeroCopy = blurGibson(ImageLoad, true, NULL);
+	check(memcmp(copied, zeroCopy, n * m * 3) == 0, "single pass after ImageFree of a mapped image", "gibson_500.bmp", '-');
+	char *again = blurGibson(ImageLoadBGR, true, NULL);
+	check(memcmp(first, again, n * m * 3) == 0, "single pass on a reloaded mapped image", "gibson_500.bmp", '-');
+	free(first);
+	free(copied);
+	free(zeroCopy);
+	free(again);
+	resetFlags();
+}
+
+/*
+ * headerCacheChecks
+ * writeBMP caches the header of the original image by file: a different image saved under the same name
+ * (a reused spool file) has to get its own header, the result read back has to be that image
+ */
+static void headerCacheChecks(void) {
+	static const int sizes[][2] = {{64, 64}, {80, 48}, {80, 48}};
+	char original[4096], result[4096], name[128];
+	unsigned int i;
+	tmpPath(original, sizeof(original), "spool_", "original.bmp");
+	tmpPath(result, sizeof(result), "spool_", "result.bmp");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		int width = sizes[i][0], height = sizes[i][1];
+		Image loaded, written;
+		char *data = malloc((size_t) width * height * 3);
+		synthesize(data, (unsigned long) width * height, 400 + i);
+		saveSynthetic(original, data, width, height);
+		free(data);
+		if (!ImageLoad(original, &loaded)) {
+			exit(1);
+		}
+		writeBMP(&loaded, original, result);
+		// a stale header doesn't even load (its file size is wrong)
+		bool readBack = ImageLoad(result, &written);
+		snprintf(name, sizeof(name), "writeBMP after a %dx%d original at the same path", width, height);
+		check(readBack && written.sizeX == loaded.sizeX && written.sizeY == loaded.sizeY
+				&& memcmp(written.data, loaded.data, (size_t) width * height * 3) == 0, name, "spool", '-');
+		ImageFree(&loaded);
+		if (readBack) {
+			ImageFree(&written);
+		}
+	}
+	unlink(original);
+	unlink(result);
+}
+
+/*
+ * planarReserveChecks
+ * planes too big for the address space can't be allocated: planarReserve has to say so and leave no planes behind
+ * (doConvolution then runs on the pixels), and the next image that fits gets its planes again
+ */
+static void planarReserveChecks(void) {
+	planar_image planes = {0};
+	bool reserved = planarReserve(&planes, 1 << 30, 1 << 20);
+	check(!reserved && planes.red == NULL && planes.green == NULL && planes.blue == NULL, "planes that don't fit in memory",
+			"-", '-');
+	reserved = planarReserve(&planes, 333, 127);
+	check(reserved && planes.red != NULL && planes.blue == planes.red + 2 * (size_t) planes.rowStride * 127,
+			"planes after a failed allocation", "-", '-');
+	free(planes.red);
+}
+
+/*
+ * planarFallbackChecks
+ * myfunction with planarConvolution when the planes can't be had for the blur but can for the sharpen: the blur falls
+ * back to the pixels, the sharpen is planar, and the caller's buffer (here the file mapping) has to be back in
+ * image->data with the right results written
+ */
+static void planarFallbackChecks(void) {
+	char results[RESULT_COUNT][4096];
+	const char *flags = "12";
+	Image loaded;
+	int f, r;
+	for (r = 0; r < RESULT_COUNT; ++r) {
+		tmpPath(results[r], sizeof(results[r]), "fallback_", resultNames[r]);
+	}
+	for (f = 0; f < 2; ++f) {
+		resetFlags();
+		planarConvolution = true;
+		if (!ImageLoadBGR("gibson_500.bmp", &loaded)) {
+			exit(1);
+		}
+		char *caller = loaded.data;
+		image = &loaded;
+		n = loaded.sizeX;
+		m = loaded.sizeY;
+		// no planes kept from before, the blur pass has to allocate them
+		free(planarSrc.red);
+		free(planarDst.red);
+		memset(&planarSrc, 0, sizeof(planarSrc));
+		memset(&planarDst, 0, sizeof(planarDst));
+		failAlignedAllocations = 1;
+		myfunction(&loaded, "gibson_500.bmp", results[0], results[1], results[2], results[3], flags[f]);
+		failAlignedAllocations = 0;
+		check(loaded.data == caller, "planar fallback for the blur only, caller's buffer back in image->data",
+				"gibson_500.bmp", flags[f]);
+		for (r = firstResult(flags[f]); r < firstResult(flags[f]) + 2; ++r) {
+			char correct[4096], name[128];
+			snprintf(correct, sizeof(correct), "%.*s_correct.bmp", (int) strlen(resultNames[r]) - 4, resultNames[r]);
+			snprintf(name, sizeof(name), "planar fallback for the blur only %s", resultNames[r]);
+			check(sameFiles(results[r], correct), name, "gibson_500.bmp", flags[f]);
+			unlink(results[r]);
+		}
+		ImageFree(&loaded);
+	}
+	resetFlags();
+}
+
+// sums the reciprocals of myfunction.c have to divide exactly: every 3x3 sum of 255s with weights up to 9
+#define RECIPROCAL_RANGE 2295
+
+// mismatches of divideBy against C division for every sum in [-range, range]
+static long reciprocalMismatches(int scale, int range) {
+	reciprocal divide = makeReciprocal(scale, range);
+	long mismatches = 0;
+	int sum;
+	for (sum = -range; sum <= range; ++sum) {
+		mismatches += divideBy(sum, &divide) != sum / scale;
+	}
+	return mismatches;
+}
+
+/*
+ * reciprocalChecks
+ * every scale against every sum of [-RECIPROCAL_RANGE, RECIPROCAL_RANGE], then each test kernel's
+ * own scale over the whole range of its sums (what describeConvolution makes its reciprocal for)
+ */
+static void reciprocalChecks(void) {
+	char name[256], input[64];
+	long mismatches = 0;
+	unsigned int k;
+	int scale, i;
+	for (scale = -RECIPROCAL_RANGE; scale <= RECIPROCAL_RANGE; ++scale) {
+		if (scale != 0) {
+			mismatches += reciprocalMismatches(scale, RECIPROCAL_RANGE);
+		}
+	}
+	snprintf(input, sizeof(input), "sums [-%d, %d]", RECIPROCAL_RANGE, RECIPROCAL_RANGE);
+	check(mismatches == 0, "reciprocal every scale", input, '-');
+
+	fillMixedKernel(&testKernels[TEST_KERNEL_COUNT - 1]);
+	for (k = 0; k < TEST_KERNEL_COUNT; ++k) {
+		test_kernel *kernel = &testKernels[k];
+		int range = kernel->filter ? 2*255 : 0;
+		for (i = 0; i < kernel->size * kernel->size; ++i) {
+			range += 255 * abs(kernel->weights[i]);
+		}
+		snprintf(name, sizeof(name), "reciprocal %s", kernel->name);
+		snprintf(input, sizeof(input), "sums [-%d, %d]", range, range);
+		check(reciprocalMismatches(kernel->scale, range) == 0, name, input, '-');
+	}
+}
+
+static double wallMs(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static double runMs(test_variant *variant, char *input, char flag) {
+	double start = wallMs();
+	runVariant(variant, input, flag, "perf_");
+	return wallMs() - start;
+}
+
+/*
+ * throughput
+ * median Mpixel/s of the whole myfunction (both passes and writes) of the variant, and of the reference run in turns
+ * with it so both see the same state of the host
+ */
+static void throughput(test_variant *variant, test_variant *reference, char *input, char flag, double *measured,
+		double *referenceMeasured) {
+	double times[PERF_RUNS], referenceTimes[PERF_RUNS];
+	int run;
+	for (run = 0; run < PERF_RUNS; ++run) {
+		referenceTimes[run] = runMs(reference, input, flag);
+		times[run] = runMs(variant, input, flag);
+	}
+	qsort(times, PERF_RUNS, sizeof(double), compareDoubles);
+	qsort(referenceTimes, PERF_RUNS, sizeof(double), compareDoubles);
+	*measured = (double) PERF_SIDE * PERF_SIDE / (times[PERF_RUNS / 2] * 1000.0);
+	*referenceMeasured = (double) PERF_SIDE * PERF_SIDE / (referenceTimes[PERF_RUNS / 2] * 1000.0);
+}
+
+/*
+ * performance
+ * baseline file lines: variant,flag,throughput relative to the copy variant
+ */
+static void performance(const char *baselineName, double tolerance, bool record) {
+	char input[4096], name[256], line[256];
+	const char *flags = "12";
+	test_variant *reference = NULL;
+	unsigned int v;
+	int f;
+	for (v = 0; v < VARIANT_COUNT; ++v) {
+		if (strcmp(variants[v].name, "copy") == 0) {
+			reference = &variants[v];
+		}
+	}
+	FILE *baseline = fopen(baselineName, record ? "w" : "r");
+	if (baseline == NULL) {
+		printf("FAIL can't open baseline %s\n", baselineName);
+		++failures;
+		return;
+	}
+	char *data = malloc((unsigned long) PERF_SIDE * PERF_SIDE * 3);
+	synthesize(data, (unsigned long) PERF_SIDE * PERF_SIDE, 0);
+	snprintf(input, sizeof(input), "%s/perf_%d.bmp", tmpDir, PERF_SIDE);
+	saveSynthetic(input, data, PERF_SIDE, PERF_SIDE);
+	free(data);
+
+	for (v = 0; v < VARIANT_COUNT; ++v) {
+		if (&variants[v] == reference) {
+			continue;
+		}
+		for (f = 0; f < 2; ++f) {
+			double measured, referenceMeasured;
+			throughput(&variants[v], reference, input, flags[f], &measured, &referenceMeasured);
+			double relative = measured / referenceMeasured;
+			if (record) {
+				fprintf(baseline, "%s,%c,%.3f\n", variants[v].name, flags[f], relative);
+				printf("RECORD %s flag %c %.3f of copy (%.2f Mpix/s against %.2f)\n", variants[v].name, flags[f], relative,
+						measured, referenceMeasured);
+				continue;
+			}
+			double expected = -1;
+			rewind(baseline);
+			while (fgets(line, sizeof(line), baseline) != NULL) {
+				char flag;
+				double value;
+				if (sscanf(line, "%255[^,],%c,%lf", name, &flag, &value) == 3 && strcmp(name, variants[v].name) == 0 && flag == flags[f]) {
+					expected = value;
+				}
+			}
+			if (expected < 0) {
+				printf("FAIL %s flag %c has no baseline\n", variants[v].name, flags[f]);
+				++failures;
+				continue;
+			}
+			bool ok = relative >= expected * (1 - tolerance);
+			printf("%s throughput %s flag %c %.3f of copy, %.2f Mpix/s against %.2f (baseline %.3f)\n", ok ? "PASS" : "FAIL",
+					variants[v].name, flags[f], relative, measured, referenceMeasured, expected);
+			if (!ok) {
+				++failures;
+			}
+		}
+	}
+	fclose(baseline);
+	unlink(input);
+}
+
+int main(int argc, char **argv) {
+	bool doCorrectness = true, doPerformance = true, record = false;
+	const char *baselineName = "perf_baseline.csv", *tmpRoot = "/tmp";
+	double tolerance = 0.3;
+	char path[4200];
+	int opt, r;
+
+	while ((opt = getopt(argc, argv, "cpRb:t:d:")) != -1) {
+		switch (opt) {
+			case 'c': doPerformance = false; break;
+			case 'p': doCorrectness = false; break;
+			case 'R': record = true; break;
+			case 'b': baselineName = optarg; break;
+			case 't': tolerance = atof(optarg); break;
+			case 'd': tmpRoot = optarg; break;
+			default:
+				printf("usage: %s [-c] [-p] [-R] [-b baseline] [-t tolerance] [-d tmpdir]\n", argv[0]);
+				return 1;
+		}
+	}
+	snprintf(tmpDir, sizeof(tmpDir), "%s/testBMP_%d", tmpRoot, (int) getpid());
+	if (mkdir(tmpDir, 0755) < 0) {
+		printf("Error creating %s\n", tmpDir);
+		return 1;
+	}
+
+	if (doCorrectness) {
+		correctness();
+		kernelChecks();
+		boxChecks();
+		gaussianChecks();
+		mappingChecks();
+		headerCacheChecks();
+		planarReserveChecks();
+		planarFallbackChecks();
+		reciprocalChecks();
+	}
+	if (doPerformance) {
+		performance(baselineName, tolerance, record);
+	}
+
+	for (r = 0; r < RESULT_COUNT; ++r) {
+		const char *prefixes[] = {"old_", "new_", "perf_"};
+		unsigned int p;
+		for (p = 0; p < 3; ++p) {
+			tmpPath(path, sizeof(path), prefixes[p], resultNames[r]);
+			unlink(path);
+		}
+	}
+	rmdir(tmpDir);
+
+	printf("%d failure(s)\n", failures);
+	return failures > 255 ? 255 : failures;
+}
@@ -1,17 +1,47 @@
+#define _GNU_SOURCE             // O_DIRECT
 #include "writeBMP.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
-void writeBMP(Image *image, const char* originalImgFileName, const char* fileName) {
+int writeBMPMode = WRITE_BMP_WRITEV;
 
-	// open the file to be written
-	FILE * bmpfile;
-	bmpfile = fopen(fileName, "wb");
-	if (bmpfile == NULL) {
-		printf("Error opening output file\n");
-		// close all open files and free any allocated memory
-		exit (1);
+// header of the last original image, so it isn't reopened for every result image
+// (per thread, like the payload buffer, so threads can write different images at the same time)
+static __thread char cachedHeaderName[4096] = "";
+static __thread char cachedHeader[BMP_HEADER_SIZE];
+// the file the header came from, a new file (or a rewritten one) at the same path is read again
+static __thread struct stat cachedHeaderStat;
+
+// payload buffer, kept between calls
+static __thread char *payload = NULL;
+static __thread unsigned long payloadCapacity = 0;
+
+static unsigned long headerInt(const char *header, int offset) {
+	const unsigned char *p = (const unsigned char *) header + offset;
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+/*
+ * readOriginalHeader
+ * the cached header is only used for the same path, the same file (device, inode, size, modification time)
+ * and an image of the width and height it has - a long running process may see another image under the same name
+ */
+static void readOriginalHeader(Image *image, const char* originalImgFileName) {
+	struct stat st;
+	if (stat(originalImgFileName, &st) == 0 && strcmp(cachedHeaderName, originalImgFileName) == 0
+			&& st.st_dev == cachedHeaderStat.st_dev && st.st_ino == cachedHeaderStat.st_ino
+			&& st.st_size == cachedHeaderStat.st_size && st.st_mtim.tv_sec == cachedHeaderStat.st_mtim.tv_sec
+			&& st.st_mtim.tv_nsec == cachedHeaderStat.st_mtim.tv_nsec
+			&& headerInt(cachedHeader, 18) == image->sizeX && headerInt(cachedHeader, 22) == image->sizeY) {
+		return;
 	}
 
 	// open BMP file of original image
@@ -22,58 +52,265 @@ void writeBMP(Image *image, const char* originalImgFileName, const char* fileNam
 	}
 
 	// read header of original image
-	char originalHeader[54];
-	fread(&originalHeader, 1, 54, srcFile);
-
-	// write the BMP file header
-	fwrite(&originalHeader, 1, 54, bmpfile);
+	if (fread(cachedHeader, 1, BMP_HEADER_SIZE, srcFile) != BMP_HEADER_SIZE) {
+		printf("Error reading header from %s\n", originalImgFileName);
+		exit (1);
+	}
 
 	// close BMP file of original image
+	fstat(fileno(srcFile), &cachedHeaderStat);
 	fclose(srcFile);
+	strncpy(cachedHeaderName, originalImgFileName, sizeof(cachedHeaderName) - 1);
+}
 
-	// calculate number of bytes per each line
-	int bytesPerLine;
-	bytesPerLine = image->sizeX * 3;  // for 24 bit images)
-	// round up to a dword boundary
-	if (bytesPerLine & 0x0003) {
-		bytesPerLine |= 0x0003;
-		++bytesPerLine;
+/*
+ * fill buffer with the file order (BGR) lines of the image, each padded to bytesPerLine,
+ * plus one zero line at the end (the original writer always wrote sizeY+1 lines, the reference outputs have it)
+ */
+static void fillPayload(Image *image, char *buffer, unsigned long bytesPerLine) {
+	unsigned long line;
+	unsigned long pixelBytes = image->sizeX * 3;
+	for (line = 0; line < image->sizeY; ++line) {
+		char *out = buffer + line * bytesPerLine;
+		char *in = image->data + line * pixelBytes;
+		if (image->bgr) {
+			// already in file order (ImageLoadBGR)
+			memcpy(out, in, pixelBytes);
+		} else {
+			swapRedBlue((unsigned char *) out, (unsigned char *) in, pixelBytes);
+		}
+		memset(out + pixelBytes, 0, bytesPerLine - pixelBytes);
 	}
+	memset(buffer + image->sizeY * bytesPerLine, 0, bytesPerLine);
+}
+
+static void writeFully(int fd, struct iovec *iov, int count) {
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("Error writing output file\n");
+			exit (1);
+		}
+		while (count > 0 && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			++iov, --count;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+}
+
+/*
+ * O_DIRECT needs the buffer, the offset and the length aligned, so the whole file is built in one aligned
+ * buffer, written rounded up to DIRECT_ALIGN, and cut back to size. Falls back to writev when the
+ * file system doesn't do O_DIRECT.
+ */
+#define DIRECT_ALIGN 4096
+static int writeDirect(const char* fileName, Image *image, unsigned long bytesPerLine, unsigned long fileSize) {
+	int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (fd < 0) {
+		return 0;
+	}
+	unsigned long alignedSize = (fileSize + DIRECT_ALIGN - 1) & ~(unsigned long) (DIRECT_ALIGN - 1);
+	void *buffer;
+	if (posix_memalign(&buffer, DIRECT_ALIGN, alignedSize)) {
+		close(fd);
+		return 0;
+	}
+	memcpy(buffer, cachedHeader, BMP_HEADER_SIZE);
+	fillPayload(image, (char *) buffer + BMP_HEADER_SIZE, bytesPerLine);
+	memset((char *) buffer + fileSize, 0, alignedSize - fileSize);
+
+	struct iovec iov = {buffer, alignedSize};
+	writeFully(fd, &iov, 1);
+	if (ftruncate(fd, fileSize) < 0) {
+		printf("Error writing output file\n");
+		exit (1);
+	}
+	close(fd);
+	free(buffer);
+	return 1;
+}
+
+/*
+ * the file is sized up front and mapped, the lines are converted straight into the page cache
+ */
+static int writeMapped(const char* fileName, Image *image, unsigned long bytesPerLine, unsigned long fileSize) {
+	int fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return 0;
+	}
+	if (ftruncate(fd, fileSize) < 0) {
+		close(fd);
+		return 0;
+	}
+	char *map = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return 0;
+	}
+	memcpy(map, cachedHeader, BMP_HEADER_SIZE);
+	fillPayload(image, map + BMP_HEADER_SIZE, bytesPerLine);
+	munmap(map, fileSize);
+	return 1;
+}
 
-	// allocate buffer to hold one line of the image
-	char *linebuf;
-	linebuf = (char *) calloc(1, bytesPerLine);
-	if (linebuf == NULL) {
-		printf ("Error allocating memory\n");
+/*
+ * writeBMP
+ * the header of the original image is read once and cached (as long as the file and the image size stay the same),
+ * the whole padded BGR payload is built with pshufb (swapRedBlue) in a buffer that is kept between calls,
+ * and header + payload go out with a single writev.
+ * writeBMPMode can switch to O_DIRECT (skips the page cache) or mmap output for very large images.
+ * The header cache and the buffer are per thread, so several threads can write at once (see myfunctionBatch).
+ */
+void writeBMP(Image *image, const char* originalImgFileName, const char* fileName) {
+
+	readOriginalHeader(image, originalImgFileName);
+
+	// calculate number of bytes per each line, rounded up to a dword boundary (24 bit images)
+	unsigned long bytesPerLine = (image->sizeX * 3 + 3) & ~3UL;
+	unsigned long payloadSize = bytesPerLine * (image->sizeY + 1);
+	unsigned long fileSize = BMP_HEADER_SIZE + payloadSize;
+
+	if (writeBMPMode == WRITE_BMP_DIRECT && writeDirect(fileName, image, bytesPerLine, fileSize)) {
+		return;
+	}
+	if (writeBMPMode == WRITE_BMP_MMAP && writeMapped(fileName, image, bytesPerLine, fileSize)) {
+		return;
+	}
+
+	// open the file to be written
+	int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Error opening output file\n");
 		// close all open files and free any allocated memory
 		exit (1);
 	}
 
-	// write the image line by line - start with the lowest line
-	int line;
-	int i;
-	char* iData = image->data;
-	for (line = 0; line <= image->sizeY; ++line) {
+	if (payloadCapacity < payloadSize) {
+		free(payload);
+		payload = malloc(payloadSize);
+		if (payload == NULL) {
+			printf ("Error allocating memory\n");
+			exit (1);
+		}
+		payloadCapacity = payloadSize;
+	}
+	fillPayload(image, payload, bytesPerLine);
+
+	struct iovec iov[2] = {{cachedHeader, BMP_HEADER_SIZE}, {payload, payloadSize}};
+	writeFully(fd, iov, 2);
+
+	// close the image file
+	close(fd);
+}
+
+void writeBMPRelease(void) {
+	free(payload);
+	payload = NULL;
+	payloadCapacity = 0;
+	cachedHeaderName[0] = '\0';
+}
+
+/*
+ * Asynchronous writes
+ * writeBMPAsync copies the image into one of WRITE_QUEUE_SLOTS snapshot slots and returns, a background thread
+ * writes the slots in order with writeBMP. A full queue blocks the caller, so at most WRITE_QUEUE_SLOTS images
+ * are held in memory. The slot buffers are kept between calls. writeBMPFlush waits for everything queued so far.
+ * writeBMP itself is safe from any thread at any time (its header cache and payload buffer are per thread, see
+ * myfunctionBatch), only writeBMPAsync/writeBMPFlush share the one global queue and must be called from one thread.
+ */
+#define WRITE_QUEUE_SLOTS 2
 
-		/*
-		* fill line linebuf with the image data for that line
-		* remember that the order is BGR
-		*/
-		for (i = 0 ; i < bytesPerLine ; i += 3) {
+typedef struct {
+	Image image;
+	unsigned long capacity;
+	char originalImgFileName[4096];
+	char fileName[4096];
+} write_slot;
 
-			linebuf[i] = iData[line*bytesPerLine + i + 2];
-			linebuf[i + 1] = iData[line*bytesPerLine + i  + 1];
-			linebuf[i + 2] = iData[line*bytesPerLine + i];
+static write_slot writeQueue[WRITE_QUEUE_SLOTS];
+static int writeQueueHead = 0;
+static int writeQueueCount = 0;
+static int writerStarted = 0;
+static pthread_t writerThread;
+static pthread_mutex_t writeQueueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeQueueNotEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writeQueueNotFull = PTHREAD_COND_INITIALIZER;
+
+static void *writerLoop(void *unused) {
+	pthread_mutex_lock(&writeQueueLock);
+	while (1) {
+		while (writeQueueCount == 0) {
+			pthread_cond_wait(&writeQueueNotEmpty, &writeQueueLock);
 		}
+		write_slot *slot = &writeQueue[writeQueueHead];
+		pthread_mutex_unlock(&writeQueueLock);
+
+		writeBMP(&slot->image, slot->originalImgFileName, slot->fileName);
 
-		/*
-		* remember that the order is BGR and if width is not a multiple
-		* of 4 then the last few bytes may be unused
-		*/
-		fwrite(linebuf, 1, bytesPerLine, bmpfile);
+		pthread_mutex_lock(&writeQueueLock);
+		writeQueueHead = (writeQueueHead + 1) % WRITE_QUEUE_SLOTS;
+		--writeQueueCount;
+		pthread_cond_broadcast(&writeQueueNotFull);
 	}
+	return NULL;
+}
 
-	// close the image file
-	fclose(bmpfile);
+void writeBMPAsync(Image *image, const char* originalImgFileName, const char* fileName) {
+	unsigned long size = image->sizeX * image->sizeY * 3;
+
+	pthread_mutex_lock(&writeQueueLock);
+	if (!writerStarted) {
+		if (pthread_create(&writerThread, NULL, writerLoop, NULL)) {
+			// no thread, no overlap
+			pthread_mutex_unlock(&writeQueueLock);
+			writeBMP(image, originalImgFileName, fileName);
+			return;
+		}
+		pthread_detach(writerThread);
+		writerStarted = 1;
+	}
+	while (writeQueueCount == WRITE_QUEUE_SLOTS) {
+		pthread_cond_wait(&writeQueueNotFull, &writeQueueLock);
+	}
+	write_slot *slot = &writeQueue[(writeQueueHead + writeQueueCount) % WRITE_QUEUE_SLOTS];
+	pthread_mutex_unlock(&writeQueueLock);
+
+	// only this thread fills slots and the writer doesn't look at it until it's counted
+	if (slot->capacity < size) {
+		free(slot->image.data);
+		slot->image.data = malloc(size);
+		if (slot->image.data == NULL) {
+			printf ("Error allocating memory\n");
+			exit (1);
+		}
+		slot->capacity = size;
+	}
+	memcpy(slot->image.data, image->data, size);
+	slot->image.sizeX = image->sizeX;
+	slot->image.sizeY = image->sizeY;
+	slot->image.bgr = image->bgr;
+	slot->image.mapping = NULL;
+	slot->image.dataMapped = 0;
+	strncpy(slot->originalImgFileName, originalImgFileName, sizeof(slot->originalImgFileName) - 1);
+	strncpy(slot->fileName, fileName, sizeof(slot->fileName) - 1);
+
+	pthread_mutex_lock(&writeQueueLock);
+	++writeQueueCount;
+	pthread_cond_signal(&writeQueueNotEmpty);
+	pthread_mutex_unlock(&writeQueueLock);
 }
 
+void writeBMPFlush(void) {
+	pthread_mutex_lock(&writeQueueLock);
+	while (writeQueueCount > 0) {
+		pthread_cond_wait(&writeQueueNotFull, &writeQueueLock);
+	}
+	pthread_mutex_unlock(&writeQueueLock);
+}
@@ -3,6 +3,22 @@
 
 #include "readBMP.h"
 
+/* how writeBMP gets the file to disk */
+#define WRITE_BMP_WRITEV 0   /* header + payload with one writev (default) */
+#define WRITE_BMP_DIRECT 1   /* O_DIRECT, bypasses the page cache, falls back to writev if unsupported */
+#define WRITE_BMP_MMAP 2     /* converts straight into a shared mapping of the output file */
+extern int writeBMPMode;
+
 void writeBMP(Image *image, const char* originalImgFileName, const char* fileName);
 
+/* Frees the buffers writeBMP keeps for the calling thread (each thread writing images has its own) */
+void writeBMPRelease(void);
+
+/* Queues a copy of the image for a background writer thread and returns (blocks while the queue is full).
+ * The queue is global: writeBMPAsync and writeBMPFlush must be called from one thread, writeBMP from any */
+void writeBMPAsync(Image *image, const char* originalImgFileName, const char* fileName);
+
+/* Waits until every image queued by writeBMPAsync is on disk */
+void writeBMPFlush(void);
+
 #endif /* WRITE_BMP_H_ */